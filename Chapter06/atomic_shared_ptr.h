@@ -0,0 +1,126 @@
+#ifndef INCLUDED_ATOMIC_SHARED_PTR_H_
+#define INCLUDED_ATOMIC_SHARED_PTR_H_
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+
+// Lock-free atomic shared pointer with split reference counts.
+// The reference count of the object is split in two: the global count in the
+// control block, and the local count packed into the same 64-bit word as the
+// pointer (assumes 48-bit addresses, as on x86-64 and ARM64). A reader
+// increments the local count and gets the pointer with a single atomic
+// fetch_add, so the object can't be deleted under it even though it does not
+// own a reference yet; it then increments the global count and gives back its
+// local count. If a writer replaced the pointer in the meantime, the writer
+// has already added all outstanding local counts to the global count, and the
+// reader subtracts its share from the global count instead. Readers never
+// wait for each other or for the writer.
+template <typename T> class atomic_shared_ptr
+{
+  struct control_block {
+    template <typename... Args> explicit control_block(Args&&... args) : value(std::forward<Args>(args)...) {}
+    std::atomic<long> count { 1 };
+    T value;
+  };
+  static void add_ref(control_block* p, long n) {
+    if (p && p->count.fetch_add(n, std::memory_order_acq_rel) + n == 0) delete p;
+  }
+
+  public:
+  // Non-threadsafe shared pointer, used to hold non-zero reference counter to
+  // safely dereference atomic_shared_ptr.
+  class shared_ptr {
+    public:
+    shared_ptr() : p_(nullptr) {}
+    shared_ptr(const shared_ptr& x) : p_(x.p_) {
+      if (p_) p_->count.fetch_add(1, std::memory_order_relaxed);
+    }
+    shared_ptr(shared_ptr&& x) : p_(x.p_) { x.p_ = nullptr; }
+    ~shared_ptr() { add_ref(p_, -1); }
+    shared_ptr& operator=(shared_ptr x) {
+      std::swap(p_, x.p_);
+      return *this;
+    }
+    T& operator*() const { return p_->value; }
+    T* operator->() const { return &p_->value; }
+    T* get() const { return p_ ? &p_->value : nullptr; }
+    explicit operator bool() const { return p_ != nullptr; }
+    bool operator==(const shared_ptr& rhs) const { return p_ == rhs.p_; }
+    bool operator!=(const shared_ptr& rhs) const { return p_ != rhs.p_; }
+
+    private:
+    friend class atomic_shared_ptr;
+    explicit shared_ptr(control_block* p) : p_(p) {}     // Takes over one reference
+    control_block* release() {
+      control_block* p = p_;
+      p_ = nullptr;
+      return p;
+    }
+    control_block* p_;
+  };
+
+  template <typename... Args> static shared_ptr make_shared(Args&&... args) {
+    return shared_ptr(new control_block(std::forward<Args>(args)...));
+  }
+
+  atomic_shared_ptr() : p_(0) {}
+  explicit atomic_shared_ptr(shared_ptr x) : p_(pack(x.release())) {}
+  atomic_shared_ptr(const atomic_shared_ptr&) = delete;
+  atomic_shared_ptr& operator=(const atomic_shared_ptr&) = delete;
+  ~atomic_shared_ptr() { add_ref(ptr(p_.load(std::memory_order_relaxed)), -1); }
+
+  shared_ptr load() const {
+    if (!ptr(p_.load(std::memory_order_relaxed))) return shared_ptr();
+    uint64_t v = p_.fetch_add(ONE, std::memory_order_acquire) + ONE;
+    control_block* const p = ptr(v);
+    if (p) p->count.fetch_add(1, std::memory_order_relaxed);
+    // Give back the local count, if the pointer is still there.
+    while (ptr(v) == p && (v & ~PTR_MASK)) {
+      if (p_.compare_exchange_weak(v, v - ONE, std::memory_order_relaxed)) return shared_ptr(p);
+    }
+    // Replaced: the writer added our local count to the global count. If the
+    // same pointer was stored again, its local count may not include ours,
+    // then the global count already has it.
+    if (p) p->count.fetch_sub(1, std::memory_order_relaxed);    // Can't drop to 0, we hold one
+    return shared_ptr(p);
+  }
+
+  shared_ptr exchange(shared_ptr x) {
+    const uint64_t v = p_.exchange(pack(x.release()), std::memory_order_acq_rel);
+    if (local(v)) add_ref(ptr(v), local(v));      // Outstanding local counts become global
+    return shared_ptr(ptr(v));
+  }
+
+  void store(shared_ptr x) { exchange(std::move(x)); }
+
+  bool compare_exchange_strong(shared_ptr& expected, shared_ptr desired) {
+    uint64_t v = p_.load(std::memory_order_relaxed);
+    while (true) {
+      if (ptr(v) != expected.p_) {
+        shared_ptr current = load();
+        if (current != expected) {
+          expected = std::move(current);
+          return false;
+        }
+        v = p_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (p_.compare_exchange_weak(v, pack(desired.p_), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+        desired.release();
+        add_ref(ptr(v), local(v) - 1);  // Release the reference held by *this
+        return true;
+      }
+    }
+  }
+
+  explicit operator bool() const { return ptr(p_.load(std::memory_order_relaxed)) != nullptr; }
+
+  private:
+  static constexpr uint64_t PTR_MASK = (uint64_t(1) << 48) - 1;
+  static constexpr uint64_t ONE = uint64_t(1) << 48;
+  static uint64_t pack(control_block* p) { return reinterpret_cast<uintptr_t>(p); }
+  static control_block* ptr(uint64_t v) { return reinterpret_cast<control_block*>(v & PTR_MASK); }
+  static long local(uint64_t v) { return v >> 48; }
+  mutable std::atomic<uint64_t> p_;
+};
+#endif // INCLUDED_ATOMIC_SHARED_PTR_H_
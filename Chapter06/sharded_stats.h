@@ -0,0 +1,241 @@
+#ifndef INCLUDED_SHARDED_STATS_H_
+#define INCLUDED_SHARDED_STATS_H_
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Sharded statistics: counters, min/max gauges and histograms that many
+// threads can update at the same time without contending for a cache line.
+// Each statistic has Shards copies, each on its own cache line, and every
+// thread updates only its own shard; reading the value adds up (or merges)
+// all shards. Updates are cheap and scale with the number of threads,
+// reading is proportional to the number of shards and is meant to be rare.
+//
+// Threads are assigned to shards either round-robin when the thread first
+// uses any sharded statistic (shard_by::thread), or by the CPU the thread is
+// running on (shard_by::cpu). With more threads than shards, or when a thread
+// migrates between CPUs, two threads may update the same shard, so shard
+// updates are still atomic, but uncontended.
+enum class shard_by { thread, cpu };
+
+template <shard_by By> inline size_t shard_index() {
+  if constexpr (By == shard_by::cpu) {
+    const int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+  } else {
+    static std::atomic<size_t> next { 0 };
+    thread_local const size_t index = next.fetch_add(1, std::memory_order_relaxed);
+    return index;
+  }
+}
+
+template <typename T> struct alignas(64) padded {
+  T value;
+};
+
+template <size_t Shards = 64, shard_by By = shard_by::thread> class sharded_counter {
+  public:
+  void add(long n) { shard().fetch_add(n, std::memory_order_relaxed); }
+  void operator++() { add(1); }
+  long value() const {
+    long sum = 0;
+    for (const auto& s : shards_) sum += s.value.load(std::memory_order_relaxed);
+    return sum;
+  }
+  void reset() {
+    for (auto& s : shards_) s.value.store(0, std::memory_order_relaxed);
+  }
+
+  private:
+  std::atomic<long>& shard() { return shards_[shard_index<By>() % Shards].value; }
+  padded<std::atomic<long>> shards_[Shards] {};
+};
+
+// Maximum (Compare = std::greater) or minimum (Compare = std::less) of all
+// values seen since the last reset. Most updates don't change the value of
+// the shard and don't write to it at all.
+template <typename Compare, size_t Shards = 64, shard_by By = shard_by::thread> class sharded_gauge {
+  public:
+  sharded_gauge() { reset(); }
+  void update(long x) {
+    std::atomic<long>& s = shards_[shard_index<By>() % Shards].value;
+    long old = s.load(std::memory_order_relaxed);
+    while (Compare()(x, old) && !s.compare_exchange_weak(old, x, std::memory_order_relaxed)) {}
+  }
+  long value() const {
+    long res = initial();
+    for (const auto& s : shards_) {
+      const long x = s.value.load(std::memory_order_relaxed);
+      if (Compare()(x, res)) res = x;
+    }
+    return res;
+  }
+  void reset() {
+    for (auto& s : shards_) s.value.store(initial(), std::memory_order_relaxed);
+  }
+
+  private:
+  static long initial() { return Compare()(LONG_MIN, LONG_MAX) ? LONG_MAX : LONG_MIN; }
+  padded<std::atomic<long>> shards_[Shards];
+};
+
+template <size_t Shards = 64, shard_by By = shard_by::thread> using sharded_max = sharded_gauge<std::greater<long>, Shards, By>;
+template <size_t Shards = 64, shard_by By = shard_by::thread> using sharded_min = sharded_gauge<std::less<long>, Shards, By>;
+
+// Histogram of non-negative values with log2 buckets: bucket 0 holds 0,
+// bucket i holds [2^(i-1), 2^i). snapshot() merges all shards into one set of
+// counts, from which percentiles are estimated.
+template <size_t Shards = 64, shard_by By = shard_by::thread> class sharded_histogram {
+  public:
+  enum { BUCKETS = 65 };
+  struct snapshot_t {
+    unsigned long counts[BUCKETS] {};
+    unsigned long total = 0;
+    // Upper bound of the bucket that contains the p-th percentile (0 < p <= 100).
+    unsigned long percentile(double p) const {
+      const unsigned long rank = std::max<unsigned long>(1, p*total/100 + 0.5);
+      unsigned long sum = 0;
+      for (size_t i = 0; i != BUCKETS; ++i) {
+        if ((sum += counts[i]) >= rank) return i == 0 ? 0 : i == 64 ? ULONG_MAX : (1UL << i) - 1;
+      }
+      return 0;
+    }
+  };
+
+  void record(unsigned long x) {
+    const size_t b = x ? 64 - __builtin_clzl(x) : 0;
+    shards_[shard_index<By>() % Shards].counts[b].fetch_add(1, std::memory_order_relaxed);
+  }
+  snapshot_t snapshot() const {
+    snapshot_t res;
+    for (const auto& s : shards_) {
+      for (size_t i = 0; i != BUCKETS; ++i) res.counts[i] += s.counts[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i != BUCKETS; ++i) res.total += res.counts[i];
+    return res;
+  }
+  void reset() {
+    for (auto& s : shards_) {
+      for (auto& c : s.counts) c.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  private:
+  struct alignas(64) shard_t {
+    std::atomic<unsigned long> counts[BUCKETS] {};
+  };
+  shard_t shards_[Shards];
+};
+
+// Hardware event counters of the calling thread (Linux perf_event). If the
+// kernel does not allow it (no PMU in a VM, perf_event_paranoid, seccomp in a
+// container), available() returns false and all counts read as 0, so code
+// that uses the counters works the same everywhere. If the PMU is shared with
+// other users, the group is counting only part of the time, and the counts
+// are scaled up by time enabled / time running.
+// Use perf_scope to count the events in a scope:
+//   perf_counters pc;
+//   { perf_scope s(pc); ... }
+//   pc.count(perf_counters::CYCLES)
+class perf_counters {
+  public:
+  enum event { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, EVENT_COUNT };
+  static const char* name(event e) {
+    static const char* const names[EVENT_COUNT] = { "cycles", "instructions", "cache-misses", "branch-misses" };
+    return names[e];
+  }
+
+  perf_counters() {
+#ifdef __linux__
+    static const unsigned long config[EVENT_COUNT] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (size_t i = 0; i != EVENT_COUNT; ++i) {
+      perf_event_attr attr;
+      ::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config[i];
+      attr.disabled = i == 0;           // Group leader starts the group
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fd_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fd_[0], 0);
+      if (fd_[i] < 0) {
+        close_all();
+        return;
+      }
+    }
+#endif
+  }
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+  ~perf_counters() { close_all(); }
+
+  bool available() const { return fd_[0] >= 0; }
+  void start() {
+#ifdef __linux__
+    if (available()) {
+      read_group(start_, start_enabled_, start_running_);
+      ioctl(fd_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+  void stop() {
+#ifdef __linux__
+    if (available()) {
+      ioctl(fd_[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+      unsigned long end[EVENT_COUNT], enabled, running;
+      read_group(end, enabled, running);
+      if (running == start_running_) return;      // Never got on the PMU
+      const double scale = double(enabled - start_enabled_)/(running - start_running_);
+      for (size_t i = 0; i != EVENT_COUNT; ++i) counts_[i] += static_cast<unsigned long>((end[i] - start_[i])*scale + 0.5);
+    }
+#endif
+  }
+  // Events counted between all start() and stop() calls so far.
+  unsigned long count(event e) const { return counts_[e]; }
+  void reset() { std::fill(counts_, counts_ + EVENT_COUNT, 0); }
+
+  private:
+  void read_group(unsigned long* values, unsigned long& enabled, unsigned long& running) {
+    struct { unsigned long nr, enabled, running; unsigned long values[EVENT_COUNT]; } buf;
+    if (::read(fd_[0], &buf, sizeof(buf)) != sizeof(buf)) {
+      std::fill(values, values + EVENT_COUNT, 0);
+      enabled = running = 0;
+      return;
+    }
+    std::copy(buf.values, buf.values + EVENT_COUNT, values);
+    enabled = buf.enabled;
+    running = buf.running;
+  }
+  void close_all() {
+    for (int& fd : fd_) {
+      if (fd >= 0) ::close(fd);
+      fd = -1;
+    }
+  }
+  int fd_[EVENT_COUNT] = { -1, -1, -1, -1 };
+  unsigned long start_[EVENT_COUNT] {};
+  unsigned long start_enabled_ = 0, start_running_ = 0;
+  unsigned long counts_[EVENT_COUNT] {};
+};
+
+class perf_scope {
+  public:
+  explicit perf_scope(perf_counters& pc) : pc_(pc) { pc_.start(); }
+  ~perf_scope() { pc_.stop(); }
+  private:
+  perf_counters& pc_;
+};
+#endif // INCLUDED_SHARDED_STATS_H_
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdlib.h>
+
+// Hazard pointers for safe memory reclamation in lock-free data structures.
+// A thread that is about to dereference a shared pointer publishes it in its
+// hazard pointer first, then checks that the pointer is still reachable.
+// Nodes removed from the data structure are retired, not deleted; a retired
+// node is deleted only when no thread has it published as hazardous. Since a
+// node can't be deleted, it can't be reallocated at the same address while
+// someone holds a hazard pointer to it, which also prevents the ABA problem.
+// Each thread owns one hazard pointer record, records are on separate cache
+// lines and are recycled when threads exit. Nodes that are still hazardous
+// when their thread exits are adopted by the next thread that scans, or
+// deleted when the program exits.
+class hazard_pointers {
+  public:
+  enum { MAX_THREADS = 256 };
+
+  // Hazard pointer of the calling thread.
+  static std::atomic<void*>& hazard() { return local().record_->ptr; }
+
+  // Publish p as hazardous and return it once it's confirmed that src still
+  // points to it (and so p was not retired before we published it).
+  template <typename T> static T* protect(const std::atomic<T*>& src) {
+    std::atomic<void*>& hp = hazard();
+    T* p = src.load(std::memory_order_relaxed);
+    while (true) {
+      hp.store(p, std::memory_order_seq_cst);
+      T* p1 = src.load(std::memory_order_seq_cst);
+      if (p1 == p) return p;
+      p = p1;
+    }
+  }
+  static void clear() { hazard().store(nullptr, std::memory_order_release); }
+
+  // Node is no longer reachable, delete it once no thread holds it.
+  template <typename T> static void retire(T* p) {
+    thread_state& ts = local();
+    ts.retired_.push_back({p, [](void* p) { delete static_cast<T*>(p); }});
+    if (ts.retired_.size() >= 2*MAX_THREADS) {
+      adopt_orphans(ts.retired_);
+      scan(ts.retired_);
+    }
+  }
+
+  private:
+  struct alignas(64) record {
+    std::atomic<void*> ptr { nullptr };
+    std::atomic<bool> active { false };
+  };
+  struct retired_t {
+    void* p;
+    void (*deleter)(void*);
+  };
+
+  // Delete all retired nodes not published in any hazard pointer.
+  static void scan(std::vector<retired_t>& retired) {
+    std::vector<void*> hazards;
+    hazards.reserve(MAX_THREADS);
+    for (size_t i = 0; i != MAX_THREADS; ++i) {
+      if (void* p = records_[i].ptr.load(std::memory_order_seq_cst)) hazards.push_back(p);
+    }
+    std::sort(hazards.begin(), hazards.end());
+    auto end = std::partition(retired.begin(), retired.end(), [&](const retired_t& r) {
+        return std::binary_search(hazards.begin(), hazards.end(), r.p);
+    });
+    for (auto it = end; it != retired.end(); ++it) it->deleter(it->p);
+    retired.erase(end, retired.end());
+  }
+
+  // Retired nodes of exited threads. Whatever is left when the program exits
+  // is deleted then: thread_local objects are destroyed before statics, so no
+  // thread can hold a hazard pointer anymore.
+  struct orphans_t {
+    std::mutex lock;
+    std::vector<retired_t> retired;
+    ~orphans_t() {
+      for (const retired_t& r : retired) r.deleter(r.p);
+    }
+  };
+
+  // Move the orphaned nodes to the retire list of the calling thread. If
+  // another thread holds the lock, it's adopting them already.
+  static void adopt_orphans(std::vector<retired_t>& retired) {
+    std::unique_lock g(orphans_.lock, std::try_to_lock);
+    if (!g || orphans_.retired.empty()) return;
+    retired.insert(retired.end(), orphans_.retired.begin(), orphans_.retired.end());
+    orphans_.retired.clear();
+  }
+
+  // Per-thread record ownership and retire list. On thread exit, nodes that
+  // are still hazardous are left to the other threads.
+  struct thread_state {
+    thread_state() {
+      for (size_t i = 0; i != MAX_THREADS; ++i) {
+        bool active = false;
+        if (!records_[i].active.load(std::memory_order_relaxed) &&
+            records_[i].active.compare_exchange_strong(active, true, std::memory_order_acquire)) {
+          record_ = records_ + i;
+          return;
+        }
+      }
+      abort();                          // Too many threads
+    }
+    ~thread_state() {
+      record_->ptr.store(nullptr, std::memory_order_release);
+      scan(retired_);
+      if (!retired_.empty()) {
+        std::lock_guard g(orphans_.lock);
+        orphans_.retired.insert(orphans_.retired.end(), retired_.begin(), retired_.end());
+      }
+      record_->active.store(false, std::memory_order_release);
+    }
+    record* record_;
+    std::vector<retired_t> retired_;
+  };
+  static thread_state& local() {
+    thread_local thread_state ts;
+    return ts;
+  }
+
+  static record records_[MAX_THREADS];
+  static orphans_t orphans_;
+};
+
+inline hazard_pointers::record hazard_pointers::records_[MAX_THREADS];
+inline hazard_pointers::orphans_t hazard_pointers::orphans_;
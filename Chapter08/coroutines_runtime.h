@@ -0,0 +1,528 @@
+#ifndef INCLUDED_COROUTINES_RUNTIME_H_
+#define INCLUDED_COROUTINES_RUNTIME_H_
+// Requires C++20.
+#include <coroutine>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "work_stealing.h"
+
+// A small coroutine runtime:
+//  - task<T>: lazily started coroutine that produces a T, awaiting it starts
+//    it and resumes the awaiter when it's done, via symmetric transfer, so a
+//    long chain of tasks that complete synchronously does not grow the stack;
+//  - thread_pool_executor: coroutines co_await schedule() to continue on one
+//    of the pool threads;
+//  - sync_wait(): run a task from a regular function and block until done;
+//  - when_all(): start a number of tasks and wait for all of them;
+//  - generator<T>: lazy sequence that can be used as an input range;
+//  - async_manual_reset_event, async_mutex, async_semaphore: awaitable
+//    synchronization primitives. A coroutine waiting on them is suspended,
+//    not blocking a thread, and is resumed by the thread that sets the event,
+//    unlocks the mutex or releases the semaphore.
+namespace coro {
+
+template <typename T = void> class task;
+
+namespace detail {
+struct task_promise_base {
+    // When the task is done, resume whoever awaited it (symmetric transfer).
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            return h.promise().continuation_;
+        }
+        void await_resume() noexcept {}
+    };
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { exception_ = std::current_exception(); }
+
+    std::coroutine_handle<> continuation_ = std::noop_coroutine();
+    std::exception_ptr exception_;
+};
+
+template <typename T> struct task_promise : task_promise_base {
+    task<T> get_return_object() noexcept;
+    template <typename U> void return_value(U&& v) { value_.emplace(std::forward<U>(v)); }
+    T result() {
+        if (exception_) std::rethrow_exception(exception_);
+        return std::move(*value_);
+    }
+    std::optional<T> value_;
+};
+
+template <> struct task_promise<void> : task_promise_base {
+    task<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+    void result() { if (exception_) std::rethrow_exception(exception_); }
+};
+} // namespace detail
+
+template <typename T> class task {
+    public:
+    using promise_type = detail::task_promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit task(handle_type h) noexcept : h_(h) {}
+    task(task&& t) noexcept : h_(std::exchange(t.h_, {})) {}
+    task& operator=(task&& t) noexcept {
+        if (this != &t) {
+            if (h_) h_.destroy();
+            h_ = std::exchange(t.h_, {});
+        }
+        return *this;
+    }
+    ~task() { if (h_) h_.destroy(); }
+
+    struct awaiter {
+        handle_type h_;
+        bool await_ready() const noexcept { return h_.done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            h_.promise().continuation_ = awaiting;
+            return h_;                              // Start the task
+        }
+        T await_resume() { return h_.promise().result(); }
+    };
+    // A moved-from task has no coroutine to run or result to return.
+    awaiter operator co_await() const {
+        if (!h_) throw std::logic_error("co_await on an empty task");
+        return awaiter{h_};
+    }
+
+    private:
+    handle_type h_;
+};
+
+template <typename T> task<T> detail::task_promise<T>::get_return_object() noexcept {
+    return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+inline task<void> detail::task_promise<void>::get_return_object() noexcept {
+    return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+// Coroutines that co_await schedule() are resumed on one of the pool threads.
+// The awaiter is the pool task: it lives in the coroutine frame until the
+// coroutine is resumed, so scheduling does not allocate.
+class thread_pool_executor {
+    public:
+    explicit thread_pool_executor(size_t nthreads = std::thread::hardware_concurrency()) : pool_(nthreads) {}
+    size_t size() const { return pool_.size(); }
+
+    struct schedule_awaiter : ws::task {
+        explicit schedule_awaiter(ws::work_stealing_pool& pool) : ws::task{&run}, pool_(pool) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            h_ = h;
+            pool_.spawn(this);
+        }
+        void await_resume() const noexcept {}
+        static void run(ws::task* t) { static_cast<schedule_awaiter*>(t)->h_.resume(); }
+        ws::work_stealing_pool& pool_;
+        std::coroutine_handle<> h_;
+    };
+    schedule_awaiter schedule() { return schedule_awaiter(pool_); }
+
+    private:
+    ws::work_stealing_pool pool_;
+};
+
+namespace detail {
+// Coroutine that starts running right away and destroys itself when done.
+struct detached_task {
+    struct promise_type {
+        detached_task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+struct sync_wait_state {
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    std::exception_ptr exception;
+};
+
+template <typename T, typename R>
+detached_task sync_wait_impl(task<T>& t, sync_wait_state& s, R& res) {
+    try {
+        if constexpr (std::is_void_v<T>) co_await t;
+        else res.emplace(co_await t);
+    } catch (...) {
+        s.exception = std::current_exception();
+    }
+    // Notify under the lock: the waiting thread can't return, and destroy s,
+    // until we release it, and we don't touch s after that.
+    std::lock_guard g(s.m);
+    s.done = true;
+    s.cv.notify_one();
+}
+} // namespace detail
+
+// Run the task to completion and return its result. The calling thread
+// blocks; the task may complete on any thread.
+template <typename T> T sync_wait(task<T>&& t) {
+    detail::sync_wait_state s;
+    std::optional<std::conditional_t<std::is_void_v<T>, char, T>> res;
+    detail::sync_wait_impl(t, s, res);
+    std::unique_lock l(s.m);
+    s.cv.wait(l, [&] { return s.done; });
+    if (s.exception) std::rethrow_exception(s.exception);
+    if constexpr (!std::is_void_v<T>) return std::move(*res);
+}
+
+namespace detail {
+// Shared by the helper coroutines that run each task of when_all(): the last
+// one to finish resumes the coroutine that awaits when_all().
+struct when_all_state {
+    explicit when_all_state(size_t n) : count(n + 1) {}
+    std::atomic<size_t> count;                      // Tasks + 1 for the awaiting coroutine
+    std::coroutine_handle<> continuation;
+    std::atomic<bool> failed { false };
+    std::exception_ptr exception;
+
+    // Called once by each task and once by the awaiting coroutine after it
+    // started all tasks. Returns true for the last one.
+    bool arrive() { return count.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+    void fail(std::exception_ptr e) {
+        if (!failed.exchange(true, std::memory_order_relaxed)) exception = e;
+    }
+};
+
+struct when_all_helper {
+    struct promise_type {
+        struct final_awaiter {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                when_all_state* s = h.promise().state_;
+                h.destroy();
+                return s->arrive() ? s->continuation : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        when_all_helper get_return_object() noexcept { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { state_->fail(std::current_exception()); }
+        when_all_state* state_ = nullptr;
+    };
+    std::coroutine_handle<promise_type> h_;
+};
+
+template <typename T, typename R> when_all_helper when_all_run(task<T>& t, R& res) {
+    if constexpr (std::is_void_v<T>) co_await t;
+    else res.emplace(co_await t);
+}
+
+// Starts the helpers and suspends until all of them are done.
+struct when_all_awaiter {
+    when_all_state& state_;
+    std::vector<when_all_helper>& helpers_;
+    bool await_ready() const noexcept { return helpers_.empty(); }
+    bool await_suspend(std::coroutine_handle<> h) {
+        state_.continuation = h;
+        for (when_all_helper& w : helpers_) {
+            w.h_.promise().state_ = &state_;
+            w.h_.resume();
+        }
+        return !state_.arrive();                    // All done already, don't suspend
+    }
+    void await_resume() const noexcept {}
+};
+} // namespace detail
+
+// Start all tasks and wait until all of them are done. The tasks run
+// concurrently only if they move themselves to other threads (for example,
+// by awaiting schedule()); otherwise they run one after the other.
+template <typename T> task<std::vector<T>> when_all(std::vector<task<T>> tasks) {
+    detail::when_all_state state(tasks.size());
+    std::vector<std::optional<T>> results(tasks.size());
+    std::vector<detail::when_all_helper> helpers;
+    helpers.reserve(tasks.size());
+    for (size_t i = 0; i != tasks.size(); ++i) helpers.push_back(detail::when_all_run(tasks[i], results[i]));
+    co_await detail::when_all_awaiter{state, helpers};
+    if (state.exception) std::rethrow_exception(state.exception);
+    std::vector<T> res;
+    res.reserve(results.size());
+    for (std::optional<T>& r : results) res.push_back(std::move(*r));
+    co_return res;
+}
+
+inline task<void> when_all(std::vector<task<void>> tasks) {
+    detail::when_all_state state(tasks.size());
+    std::optional<char> unused;
+    std::vector<detail::when_all_helper> helpers;
+    helpers.reserve(tasks.size());
+    for (task<void>& t : tasks) helpers.push_back(detail::when_all_run(t, unused));
+    co_await detail::when_all_awaiter{state, helpers};
+    if (state.exception) std::rethrow_exception(state.exception);
+}
+
+// Lazy sequence of values produced by co_yield, usable in range-for and with
+// the standard range adaptors.
+template <typename T> class generator {
+    public:
+    using value_type = std::remove_cvref_t<T>;
+    using reference = const value_type&;
+
+    struct promise_type {
+        generator get_return_object() noexcept { return generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        // The yielded object lives until the generator is resumed, so we
+        // can keep a pointer instead of a copy.
+        std::suspend_always yield_value(const value_type& v) noexcept {
+            value_ = std::addressof(v);
+            return {};
+        }
+        std::suspend_always yield_value(value_type&& v) noexcept {
+            value_ = std::addressof(v);
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() { exception_ = std::current_exception(); }
+        template <typename U> std::suspend_never await_transform(U&&) = delete;   // No co_await in generators
+        const value_type* value_ = nullptr;
+        std::exception_ptr exception_;
+    };
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    class iterator {
+        public:
+        using iterator_category = std::input_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = generator::value_type;
+        iterator() = default;
+        explicit iterator(handle_type h) : h_(h) {}
+        reference operator*() const { return *h_.promise().value_; }
+        iterator& operator++() {
+            h_.resume();
+            if (h_.done() && h_.promise().exception_) std::rethrow_exception(h_.promise().exception_);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        friend bool operator==(const iterator& it, std::default_sentinel_t) noexcept { return !it.h_ || it.h_.done(); }
+        private:
+        handle_type h_;
+    };
+
+    explicit generator(handle_type h) noexcept : h_(h) {}
+    generator(generator&& g) noexcept : h_(std::exchange(g.h_, {})) {}
+    generator& operator=(generator&& g) noexcept {
+        if (this != &g) {
+            if (h_) h_.destroy();
+            h_ = std::exchange(g.h_, {});
+        }
+        return *this;
+    }
+    ~generator() { if (h_) h_.destroy(); }
+
+    // Starts the generator, may be called only once.
+    iterator begin() {
+        iterator it(h_);
+        if (h_) ++it;
+        return it;
+    }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+    private:
+    handle_type h_;
+};
+
+// Manual-reset event from Lewis Baker's "Understanding Awaitables" (see
+// coroutines_awaitable.C): the awaiters form a lock-free list in the state
+// word, set() takes the whole list and resumes every awaiter.
+class async_manual_reset_event {
+    public:
+    explicit async_manual_reset_event(bool set = false) noexcept : state_(set ? this : nullptr) {}
+    async_manual_reset_event(const async_manual_reset_event&) = delete;
+    async_manual_reset_event& operator=(const async_manual_reset_event&) = delete;
+
+    bool is_set() const noexcept { return state_.load(std::memory_order_acquire) == this; }
+
+    struct awaiter {
+        const async_manual_reset_event& event_;
+        std::coroutine_handle<> h_ {};
+        awaiter* next_ = nullptr;
+        bool await_ready() const noexcept { return event_.is_set(); }
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            const void* const set_state = &event_;
+            h_ = h;
+            void* old = event_.state_.load(std::memory_order_acquire);
+            do {
+                if (old == set_state) return false;         // Set while we were getting ready
+                next_ = static_cast<awaiter*>(old);
+            } while (!event_.state_.compare_exchange_weak(old, this, std::memory_order_release, std::memory_order_acquire));
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+    awaiter operator co_await() const noexcept { return awaiter{*this}; }
+
+    void set() noexcept {
+        void* old = state_.exchange(this, std::memory_order_acq_rel);
+        if (old == this) return;
+        for (awaiter* w = static_cast<awaiter*>(old); w; ) {
+            awaiter* next = w->next_;                       // Resuming may destroy w
+            w->h_.resume();
+            w = next;
+        }
+    }
+    void reset() noexcept {
+        void* old = this;
+        state_.compare_exchange_strong(old, nullptr, std::memory_order_acquire);
+    }
+
+    private:
+    // this => set, otherwise not set and the head of the list of awaiters.
+    mutable std::atomic<void*> state_;
+};
+
+// Mutex for coroutines, with the same lock-free list of awaiters in the
+// state word as the event. The state is one of:
+//  - NOT_LOCKED;
+//  - nullptr: locked, no awaiters;
+//  - awaiter*: locked, head of the list of new awaiters, most recent first.
+// unlock() moves the new awaiters into a FIFO list that only the lock holder
+// touches, and resumes the first one, which then owns the lock.
+class async_mutex {
+    public:
+    async_mutex() noexcept : state_(not_locked()) {}
+    async_mutex(const async_mutex&) = delete;
+    async_mutex& operator=(const async_mutex&) = delete;
+
+    bool try_lock() noexcept {
+        void* old = not_locked();
+        return state_.compare_exchange_strong(old, nullptr, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    struct lock_awaiter {
+        async_mutex& m_;
+        std::coroutine_handle<> h_ {};
+        lock_awaiter* next_ = nullptr;
+        bool await_ready() noexcept { return m_.try_lock(); }
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            h_ = h;
+            void* old = m_.state_.load(std::memory_order_relaxed);
+            while (true) {
+                if (old == not_locked()) {
+                    if (m_.state_.compare_exchange_weak(old, nullptr, std::memory_order_acquire, std::memory_order_relaxed)) return false;
+                } else {
+                    next_ = static_cast<lock_awaiter*>(old);
+                    if (m_.state_.compare_exchange_weak(old, this, std::memory_order_release, std::memory_order_relaxed)) return true;
+                }
+            }
+        }
+        void await_resume() const noexcept {}
+    };
+    // co_await m.lock(); ... m.unlock();
+    lock_awaiter lock() noexcept { return lock_awaiter{*this}; }
+
+    // Lock guard returned by co_await m.scoped_lock().
+    class scoped_lock_t {
+        public:
+        explicit scoped_lock_t(async_mutex& m) : m_(&m) {}
+        scoped_lock_t(scoped_lock_t&& l) noexcept : m_(std::exchange(l.m_, nullptr)) {}
+        ~scoped_lock_t() { if (m_) m_->unlock(); }
+        private:
+        async_mutex* m_;
+    };
+    struct scoped_lock_awaiter : lock_awaiter {
+        scoped_lock_t await_resume() const noexcept { return scoped_lock_t(m_); }
+    };
+    scoped_lock_awaiter scoped_lock() noexcept { return scoped_lock_awaiter{{*this}}; }
+
+    // The next awaiter, if any, is resumed on the calling thread.
+    void unlock() {
+        lock_awaiter* head = waiters_;
+        if (!head) {
+            void* old = nullptr;
+            if (state_.compare_exchange_strong(old, not_locked(), std::memory_order_release, std::memory_order_relaxed)) return;
+            // There are new awaiters, take them all and reverse into FIFO order.
+            old = state_.exchange(nullptr, std::memory_order_acquire);
+            for (lock_awaiter* w = static_cast<lock_awaiter*>(old); w; ) {
+                lock_awaiter* next = w->next_;
+                w->next_ = head;
+                head = w;
+                w = next;
+            }
+        }
+        waiters_ = head->next_;
+        head->h_.resume();                                  // Lock ownership goes to head
+    }
+
+    private:
+    static void* not_locked() noexcept { return reinterpret_cast<void*>(1); }
+    std::atomic<void*> state_;
+    lock_awaiter* waiters_ = nullptr;                       // FIFO, owned by the lock holder
+};
+
+// Counting semaphore for coroutines. Acquiring a permit when there is one
+// is a CAS on the count; otherwise the awaiter joins a FIFO list and
+// release() hands its permit directly to the first awaiter.
+class async_semaphore {
+    public:
+    explicit async_semaphore(long count) noexcept : count_(count) {}
+    async_semaphore(const async_semaphore&) = delete;
+    async_semaphore& operator=(const async_semaphore&) = delete;
+
+    bool try_acquire() noexcept {
+        long c = count_.load(std::memory_order_relaxed);
+        while (c > 0) {
+            if (count_.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    struct acquire_awaiter {
+        async_semaphore& s_;
+        std::coroutine_handle<> h_ {};
+        bool await_ready() noexcept { return s_.try_acquire(); }
+        bool await_suspend(std::coroutine_handle<> h) {
+            h_ = h;
+            std::lock_guard g(s_.lock_);
+            if (s_.try_acquire()) return false;             // Released while we were getting ready
+            s_.waiters_.push_back(this);
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+    acquire_awaiter acquire() noexcept { return acquire_awaiter{*this}; }
+
+    // The awaiter that gets the permit, if any, is resumed on the calling thread.
+    void release() {
+        acquire_awaiter* w = nullptr;
+        {
+            std::lock_guard g(lock_);
+            if (waiters_.empty()) {
+                count_.fetch_add(1, std::memory_order_release);
+                return;
+            }
+            w = waiters_.front();
+            waiters_.pop_front();
+        }
+        w->h_.resume();
+    }
+
+    private:
+    std::atomic<long> count_;
+    std::mutex lock_;
+    std::deque<acquire_awaiter*> waiters_;
+};
+
+} // namespace coro
+#endif // INCLUDED_COROUTINES_RUNTIME_H_
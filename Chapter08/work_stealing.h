@@ -0,0 +1,408 @@
+#ifndef INCLUDED_WORK_STEALING_H_
+#define INCLUDED_WORK_STEALING_H_
+// Requires C++20 (std::atomic::wait/notify).
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+
+// Work-stealing thread pool and parallel algorithms built on it.
+//
+// Each worker thread has its own Chase-Lev deque of tasks: the owner pushes
+// and pops tasks at the bottom without any read-modify-write operations in
+// the common case, other workers steal from the top. Tasks submitted from
+// outside the pool go into a shared queue. The parallel algorithms are
+// fork-join: a task splits its range in two, pushes one half as a new task
+// for someone to steal, works on the other half, and then waits for the
+// stolen half, running other tasks while it waits.
+namespace ws {
+
+// Unit of work. Tasks are not owned by the pool; fork-join tasks live on the
+// stack of the task that spawned them and are waited for before it returns.
+struct task {
+    void (*run)(task*);
+};
+
+// Chase-Lev work-stealing deque of task pointers, with the memory orders from
+// Le, Pop, Cohen, Zappa Nardelli, "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (2013).
+// push() and take() may be called only by the owner thread, steal() by any
+// thread. The array grows when full; old arrays are kept until the deque is
+// destroyed because a thief may still be reading from them.
+class chase_lev_deque {
+    struct array {
+        explicit array(size_t n) : mask(n - 1), data(new std::atomic<task*>[n]) {}
+        size_t size() const { return mask + 1; }
+        task* get(long i) const { return data[i & mask].load(std::memory_order_relaxed); }
+        void put(long i, task* t) { data[i & mask].store(t, std::memory_order_relaxed); }
+        const size_t mask;
+        std::unique_ptr<std::atomic<task*>[]> data;
+    };
+
+    public:
+    explicit chase_lev_deque(size_t capacity = 1024) {
+        arrays_.emplace_back(new array(capacity));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+
+    void push(task* t) {
+        const long b = bottom_.load(std::memory_order_relaxed);
+        const long t0 = top_.load(std::memory_order_acquire);
+        array* a = array_.load(std::memory_order_relaxed);
+        if (b - t0 > long(a->size()) - 1) a = grow(a, t0, b);
+        a->put(b, t);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    task* take() {
+        const long b = bottom_.load(std::memory_order_relaxed) - 1;
+        array* a = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t0 = top_.load(std::memory_order_relaxed);
+        task* res = nullptr;
+        if (t0 <= b) {
+            res = a->get(b);
+            if (t0 == b) {                  // Last element, race with the thieves for it
+                if (!top_.compare_exchange_strong(t0, t0 + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) res = nullptr;
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {                            // Deque was empty
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return res;
+    }
+
+    task* steal() {
+        long t0 = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const long b = bottom_.load(std::memory_order_acquire);
+        if (t0 >= b) return nullptr;
+        // The array pointer is published with release in grow().
+        const array* a = array_.load(std::memory_order_acquire);
+        task* res = a->get(t0);
+        if (!top_.compare_exchange_strong(t0, t0 + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+        return res;
+    }
+
+    bool empty() const {
+        return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+    }
+
+    private:
+    array* grow(array* a, long t0, long b) {
+        array* a1 = new array(2*a->size());
+        for (long i = t0; i != b; ++i) a1->put(i, a->get(i));
+        arrays_.emplace_back(a1);
+        array_.store(a1, std::memory_order_release);
+        return a1;
+    }
+
+    alignas(64) std::atomic<long> top_ { 0 };
+    alignas(64) std::atomic<long> bottom_ { 0 };
+    std::atomic<array*> array_;
+    std::vector<std::unique_ptr<array>> arrays_;    // Owner thread only
+};
+
+class work_stealing_pool {
+    public:
+    explicit work_stealing_pool(size_t nthreads = std::thread::hardware_concurrency()) :
+        workers_(std::max<size_t>(1, nthreads))
+    {
+        for (size_t i = 0; i != workers_.size(); ++i) {
+            workers_[i].thread = std::thread([this, i] { worker_loop(i); });
+        }
+    }
+    ~work_stealing_pool() {
+        done_.store(true, std::memory_order_seq_cst);
+        wake_all();
+        for (worker& w : workers_) w.thread.join();
+    }
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    size_t size() const { return workers_.size(); }
+
+    // Make the task available for execution. From a worker of this pool, the
+    // task goes into the worker's own deque, otherwise into the shared queue.
+    void spawn(task* t) {
+        if (current_.pool == this) {
+            workers_[current_.index].tasks.push(t);
+        } else {
+            std::lock_guard g(inject_lock_);
+            inject_.push_back(t);
+            injected_.store(true, std::memory_order_relaxed);
+        }
+        wake_one();
+    }
+
+    // Wait until done is true. On a worker thread, run other tasks while
+    // waiting, this is what lets fork-join tasks wait for their children
+    // without blocking a worker.
+    void wait(const std::atomic<bool>& done) {
+        if (current_.pool != this) {
+            // Sleep on the pool's completion counter, not on done: the task
+            // that owns done may be destroyed as soon as done is set.
+            while (true) {
+                const unsigned c = completed_.load(std::memory_order_seq_cst);
+                if (done.load(std::memory_order_seq_cst)) return;
+                completed_.wait(c, std::memory_order_seq_cst);
+            }
+        }
+        while (!done.load(std::memory_order_acquire)) {
+            if (task* t = find_task(current_.index)) t->run(t);
+        }
+    }
+
+    // Run f() on the pool and wait for it to complete.
+    template <typename F> void run(F&& f) {
+        if (current_.pool == this) { f(); return; }
+        fork_task<F> t(std::forward<F>(f));
+        t.external = true;
+        spawn(&t);
+        wait(t.done);
+    }
+
+    // Task that calls f() and then signals completion.
+    template <typename F> struct fork_task : task {
+        explicit fork_task(F&& f) : task{&invoke}, f(std::forward<F>(f)) {}
+        static void invoke(task* t) {
+            fork_task* self = static_cast<fork_task*>(t);
+            self->f();
+            if (!self->external) {
+                self->done.store(true, std::memory_order_release);
+                return;
+            }
+            // The waiting thread is not a worker and may be asleep.
+            work_stealing_pool* pool = current_.pool;
+            self->done.store(true, std::memory_order_seq_cst);     // self may be gone after this
+            pool->completed_.fetch_add(1, std::memory_order_seq_cst);
+            pool->completed_.notify_all();
+        }
+        F f;
+        std::atomic<bool> done { false };
+        bool external = false;              // Waited for by a thread outside of the pool
+    };
+
+    // Run f1() and f2() potentially in parallel: f2() is offered for stealing
+    // while the calling thread runs f1(). Must be called on a worker thread.
+    template <typename F1, typename F2> void fork_join(F1&& f1, F2&& f2) {
+        fork_task<F2> t(std::forward<F2>(f2));
+        chase_lev_deque& tasks = workers_[current_.index].tasks;
+        tasks.push(&t);
+        wake_one();
+        f1();
+        // Most of the time nobody has stolen f2() and it's still at the bottom
+        // of our deque, so we run it ourselves.
+        if (task* t1 = tasks.take()) {
+            if (t1 == &t) { t.f(); return; }
+            t1->run(t1);            // Can't happen in strict fork-join, but be safe
+        }
+        wait(t.done);
+    }
+
+    private:
+    struct alignas(64) worker {
+        chase_lev_deque tasks;
+        std::thread thread;
+    };
+    struct current_t {
+        work_stealing_pool* pool = nullptr;
+        size_t index = 0;
+    };
+    static thread_local current_t current_;
+
+    // Own deque first, then the shared queue, then steal from a random victim.
+    task* find_task(size_t self) {
+        if (task* t = workers_[self].tasks.take()) return t;
+        if (injected_.load(std::memory_order_relaxed)) {
+            std::lock_guard g(inject_lock_);
+            if (!inject_.empty()) {
+                task* t = inject_.front();
+                inject_.pop_front();
+                if (inject_.empty()) injected_.store(false, std::memory_order_relaxed);
+                return t;
+            }
+        }
+        const size_t n = workers_.size();
+        thread_local unsigned long x = (unsigned long)&x | 1;
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        for (size_t i = 0, v = x % n; i != n; ++i, v = (v + 1 == n ? 0 : v + 1)) {
+            if (v == self) continue;
+            if (task* t = workers_[v].tasks.steal()) return t;
+        }
+        return nullptr;
+    }
+
+    bool has_work() const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (injected_.load(std::memory_order_seq_cst)) return true;
+        for (const worker& w : workers_) if (!w.tasks.empty()) return true;
+        return false;
+    }
+
+    void worker_loop(size_t self) {
+        current_ = {this, self};
+        for (int idle = 0; !done_.load(std::memory_order_relaxed); ) {
+            if (task* t = find_task(self)) {
+                t->run(t);
+                idle = 0;
+                continue;
+            }
+            if (++idle < SPIN_COUNT) continue;
+            // Same protocol as the blocking queue: announce that we are going
+            // to sleep, then check again for work before sleeping.
+            sleepers_.fetch_add(1, std::memory_order_seq_cst);
+            const unsigned s = signal_.load(std::memory_order_seq_cst);
+            if (!has_work() && !done_.load(std::memory_order_seq_cst)) signal_.wait(s, std::memory_order_seq_cst);
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            idle = 0;
+        }
+    }
+
+    void wake_one() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) == 0) return;
+        signal_.fetch_add(1, std::memory_order_seq_cst);
+        signal_.notify_one();
+    }
+    void wake_all() {
+        signal_.fetch_add(1, std::memory_order_seq_cst);
+        signal_.notify_all();
+    }
+
+    static constexpr int SPIN_COUNT = 1024;
+    std::vector<worker> workers_;
+    std::mutex inject_lock_;
+    std::deque<task*> inject_;
+    std::atomic<bool> injected_ { false };
+    alignas(64) std::atomic<int> sleepers_ { 0 };
+    alignas(64) std::atomic<unsigned> signal_ { 0 };
+    alignas(64) std::atomic<unsigned> completed_ { 0 };
+    std::atomic<bool> done_ { false };
+};
+
+inline thread_local work_stealing_pool::current_t work_stealing_pool::current_;
+
+// Grain size used when the caller passes 0: enough pieces for load balancing
+// (8 per thread), but not so small that the task overhead dominates.
+inline size_t default_grain(size_t n, const work_stealing_pool& pool) {
+    return std::max<size_t>(1024, n/(8*pool.size()));
+}
+
+namespace detail {
+template <typename It, typename F>
+void for_each_range(work_stealing_pool& pool, It first, It last, F& f, size_t grain) {
+    if (size_t(last - first) <= grain) {
+        std::for_each(first, last, f);
+        return;
+    }
+    It mid = first + (last - first)/2;
+    pool.fork_join([&] { for_each_range(pool, first, mid, f, grain); },
+                   [&] { for_each_range(pool, mid, last, f, grain); });
+}
+
+template <typename It, typename T, typename Op>
+T reduce_range(work_stealing_pool& pool, It first, It last, Op& op, size_t grain) {
+    if (size_t(last - first) <= grain) {
+        T res = *first;
+        for (++first; first != last; ++first) res = op(res, *first);
+        return res;
+    }
+    It mid = first + (last - first)/2;
+    T left, right;
+    pool.fork_join([&] { left = reduce_range<It, T>(pool, first, mid, op, grain); },
+                   [&] { right = reduce_range<It, T>(pool, mid, last, op, grain); });
+    return op(left, right);
+}
+
+// Merge sorted [a1, e1) and [a2, e2) into out, splitting the larger range in
+// half and the other one at the same value, so both halves can run in parallel.
+// The larger range must have at least 2 elements to be split, otherwise the
+// second half would be the whole input again.
+template <typename T, typename Cmp>
+void merge_range(work_stealing_pool& pool, T* a1, T* e1, T* a2, T* e2, T* out, Cmp& cmp, size_t grain) {
+    if (e1 - a1 < e2 - a2) {
+        std::swap(a1, a2);
+        std::swap(e1, e2);
+    }
+    if (size_t((e1 - a1) + (e2 - a2)) <= grain || e1 - a1 < 2) {
+        std::merge(std::make_move_iterator(a1), std::make_move_iterator(e1),
+                   std::make_move_iterator(a2), std::make_move_iterator(e2), out, cmp);
+        return;
+    }
+    T* m1 = a1 + (e1 - a1)/2;
+    T* m2 = std::lower_bound(a2, e2, *m1, cmp);
+    T* mout = out + (m1 - a1) + (m2 - a2);
+    pool.fork_join([&] { merge_range(pool, a1, m1, a2, m2, out, cmp, grain); },
+                   [&] { merge_range(pool, m1, e1, m2, e2, mout, cmp, grain); });
+}
+
+// Sort [a, a + n), the result goes into tmp if to_tmp is true, otherwise into a.
+template <typename T, typename Cmp>
+void merge_sort_range(work_stealing_pool& pool, T* a, T* tmp, size_t n, bool to_tmp, Cmp& cmp, size_t grain) {
+    if (n <= grain) {
+        std::sort(a, a + n, cmp);
+        if (to_tmp) std::move(a, a + n, tmp);
+        return;
+    }
+    const size_t m = n/2;
+    pool.fork_join([&] { merge_sort_range(pool, a, tmp, m, !to_tmp, cmp, grain); },
+                   [&] { merge_sort_range(pool, a + m, tmp + m, n - m, !to_tmp, cmp, grain); });
+    T* src = to_tmp ? a : tmp;
+    T* dst = to_tmp ? tmp : a;
+    merge_range(pool, src, src + m, src + m, src + n, dst, cmp, grain);
+}
+} // namespace detail
+
+// Call f(x) for every element of the random access range [first, last).
+// Ranges of up to grain elements are processed sequentially.
+template <typename It, typename F>
+void parallel_for_each(work_stealing_pool& pool, It first, It last, F f, size_t grain = 0) {
+    if (first == last) return;
+    if (grain == 0) grain = default_grain(last - first, pool);
+    if (size_t(last - first) <= grain) {        // Not worth waking up the pool
+        std::for_each(first, last, f);
+        return;
+    }
+    pool.run([&] { detail::for_each_range(pool, first, last, f, grain); });
+}
+
+// Combine init and all elements of [first, last) with op, which must be
+// associative; the order of operations is not specified.
+template <typename It, typename T, typename Op>
+T parallel_reduce(work_stealing_pool& pool, It first, It last, T init, Op op, size_t grain = 0) {
+    if (first == last) return init;
+    if (grain == 0) grain = default_grain(last - first, pool);
+    if (size_t(last - first) <= grain) return op(init, detail::reduce_range<It, T>(pool, first, last, op, grain));
+    T res;
+    pool.run([&] { res = detail::reduce_range<It, T>(pool, first, last, op, grain); });
+    return op(init, res);
+}
+
+// Merge sort of a contiguous range: halves are sorted in parallel, then
+// merged in parallel, alternating between the range and a temporary buffer.
+template <typename It, typename Cmp = std::less<>>
+void parallel_sort(work_stealing_pool& pool, It first, It last, Cmp cmp = Cmp(), size_t grain = 0) {
+    using T = typename std::iterator_traits<It>::value_type;
+    const size_t n = last - first;
+    if (n < 2) return;
+    if (grain == 0) grain = default_grain(n, pool);
+    if (n <= grain) {
+        std::sort(first, last, cmp);
+        return;
+    }
+    std::vector<T> tmp(n);
+    T* a = &*first;
+    pool.run([&] { detail::merge_sort_range(pool, a, tmp.data(), n, false, cmp, grain); });
+}
+
+} // namespace ws
+#endif // INCLUDED_WORK_STEALING_H_
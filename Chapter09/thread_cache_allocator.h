@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-class allocator with per-thread caches. Small allocations are rounded
+// up to one of a fixed set of sizes; each thread keeps a free list of blocks
+// for every size class and allocates from it without any synchronization.
+// When a thread's free list is empty, it takes a whole batch of blocks from
+// the central pool, and when the list grows too long (for example, because
+// this thread frees memory allocated by other threads), it returns a batch to
+// the central pool. The central pool takes a lock once per batch, not once per
+// block. Memory is obtained from the system in large chunks that are never
+// returned. Allocations larger than MAX_SIZE go directly to operator new.
+// The size must be passed to deallocate(), there are no block headers.
+class thread_cache_allocator {
+  public:
+  enum { MAX_SIZE = 32768 };
+
+  static void* allocate(size_t n) {
+    if (n > MAX_SIZE) return ::operator new(n);
+    free_list& l = local().lists_[size_class(n)];
+    if (!l.head) fetch(size_class(n), l);
+    free_block* b = l.head;
+    l.head = b->next;
+    --l.count;
+    return b;
+  }
+
+  static void deallocate(void* p, size_t n) {
+    if (n > MAX_SIZE) return ::operator delete(p);
+    const size_t c = size_class(n);
+    free_list& l = local().lists_[c];
+    free_block* b = static_cast<free_block*>(p);
+    b->next = l.head;
+    l.head = b;
+    if (++l.count > 2*batch_count(c)) release(c, l);
+  }
+
+  // Size of the block actually allocated for n bytes.
+  static size_t allocation_size(size_t n) { return n > MAX_SIZE ? n : class_size(size_class(n)); }
+
+  private:
+  // Size classes are multiples of 16 up to 256, then 4 classes for each power
+  // of 2 up to MAX_SIZE: 320, 384, 448, 512, 640, ..., 32768. The waste is at
+  // most 25%, and all blocks are 16-byte aligned.
+  enum { CLASS_COUNT = 16 + 4*7 };
+  static size_t size_class(size_t n) {
+    if (n <= 256) return n ? (n - 1)/16 : 0;
+    const size_t lg = 64 - __builtin_clzl(n - 1);      // 2^(lg-1) < n <= 2^lg
+    return 16 + (lg - 9)*4 + (((n - 1) >> (lg - 3)) & 3);
+  }
+  static size_t class_size(size_t c) {
+    if (c < 16) return (c + 1)*16;
+    const size_t lg = 9 + (c - 16)/4;
+    return (5 + (c - 16)%4) << (lg - 3);
+  }
+  // Number of blocks moved between a thread cache and the central pool at once.
+  static size_t batch_count(size_t c) { return std::clamp<size_t>(8192/class_size(c), 2, 64); }
+
+  struct free_block { free_block* next; };
+  struct free_list {
+    free_block* head = nullptr;
+    size_t count = 0;
+  };
+
+  // Thread cache. On thread exit, all cached blocks go back to the central pool.
+  struct thread_cache {
+    free_list lists_[CLASS_COUNT];
+    ~thread_cache() {
+      for (size_t c = 0; c != CLASS_COUNT; ++c) {
+        while (lists_[c].head) release(c, lists_[c]);
+      }
+    }
+  };
+  static thread_cache& local() {
+    thread_local thread_cache tc;
+    return tc;
+  }
+
+  // Central pool for one size class: a stack of batches, each one is a list
+  // of batch_count() blocks, a list of leftover blocks, and the unused part
+  // of the last chunk.
+  struct alignas(64) central_list {
+    std::mutex lock;
+    std::vector<free_block*> batches;
+    free_block* partial = nullptr;
+    size_t partial_count = 0;
+    char* chunk = nullptr;
+    char* chunk_end = nullptr;
+  };
+  enum { CHUNK_SIZE = 1 << 18 };
+
+  // Refill an empty thread free list with one batch.
+  static void fetch(size_t c, free_list& l) {
+    central_list& cl = central_[c];
+    const size_t size = class_size(c), count = batch_count(c);
+    std::lock_guard g(cl.lock);
+    if (!cl.batches.empty()) {
+      l.head = cl.batches.back();
+      l.count = count;
+      cl.batches.pop_back();
+      return;
+    }
+    if (cl.partial) {
+      l.head = cl.partial;
+      l.count = cl.partial_count;
+      cl.partial = nullptr;
+      cl.partial_count = 0;
+      return;
+    }
+    if (size_t(cl.chunk_end - cl.chunk) < size*count) {
+      cl.chunk = static_cast<char*>(::operator new(CHUNK_SIZE));   // Never freed
+      cl.chunk_end = cl.chunk + CHUNK_SIZE;
+    }
+    free_block* head = nullptr;
+    for (size_t i = 0; i != count; ++i) {
+      free_block* b = reinterpret_cast<free_block*>(cl.chunk_end -= size);
+      b->next = head;
+      head = b;
+    }
+    l.head = head;
+    l.count = count;
+  }
+
+  // Move one batch (or all blocks, if fewer) from a thread free list to the
+  // central pool. Partial batches (only on thread exit) are collected in a
+  // separate list until there are enough blocks to make a whole batch.
+  static void release(size_t c, free_list& l) {
+    const size_t count = std::min(batch_count(c), l.count);
+    free_block* head = l.head;
+    free_block* last = head;
+    for (size_t i = 1; i < count; ++i) last = last->next;
+    l.head = last->next;
+    l.count -= count;
+    central_list& cl = central_[c];
+    std::lock_guard g(cl.lock);
+    if (count == batch_count(c)) {
+      last->next = nullptr;
+      cl.batches.push_back(head);
+      return;
+    }
+    last->next = cl.partial;
+    cl.partial = head;
+    cl.partial_count += count;
+    if (cl.partial_count >= batch_count(c)) {
+      head = last = cl.partial;
+      for (size_t i = 1; i < batch_count(c); ++i) last = last->next;
+      cl.partial = last->next;
+      cl.partial_count -= batch_count(c);
+      last->next = nullptr;
+      cl.batches.push_back(head);
+    }
+  }
+
+  static central_list central_[CLASS_COUNT];
+};
+
+inline thread_cache_allocator::central_list thread_cache_allocator::central_[CLASS_COUNT];
+
+// Bump-pointer arena for request-scoped data: allocation only advances a
+// pointer, individual blocks are never freed, and reset() releases everything
+// at once. Memory comes from blocks of growing size; after a reset, the arena
+// keeps a single block large enough for everything allocated since the last
+// reset, so a steady-state request cycle allocates nothing from the system.
+class arena {
+  public:
+  explicit arena(size_t block_size = 1 << 16) : next_size_(block_size) {}
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+  ~arena() { free_blocks(); }
+
+  void* allocate(size_t n, size_t align = alignof(max_align_t)) {
+    char* p = align_up(cur_, align);
+    if (size_t(end_ - cur_) < n + (p - cur_)) {
+      add_block(n + align);
+      p = align_up(cur_, align);
+    }
+    cur_ = p + n;
+    used_ += n;
+    return p;
+  }
+
+  void reset() {
+    if (head_ && head_->next) {         // Coalesce into one block
+      const size_t size = total_;
+      free_blocks();
+      next_size_ = size;
+      add_block(0);
+    } else if (head_) {
+      cur_ = head_->data();
+    }
+    used_ = 0;
+  }
+
+  // Bytes allocated since the last reset.
+  size_t used() const { return used_; }
+
+  private:
+  struct block {
+    block* next;
+    size_t size;
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+  };
+  static char* align_up(char* p, size_t align) {
+    return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(align - 1));
+  }
+  void add_block(size_t min_size) {
+    const size_t size = std::max(next_size_, min_size);
+    block* b = static_cast<block*>(::operator new(sizeof(block) + size));
+    b->next = head_;
+    b->size = size;
+    head_ = b;
+    cur_ = b->data();
+    end_ = cur_ + size;
+    total_ += size;
+    next_size_ = 2*size;
+  }
+  void free_blocks() {
+    while (head_) {
+      block* b = head_;
+      head_ = b->next;
+      ::operator delete(b);
+    }
+    cur_ = end_ = nullptr;
+    total_ = 0;
+  }
+
+  block* head_ = nullptr;
+  char* cur_ = nullptr;
+  char* end_ = nullptr;
+  size_t next_size_;
+  size_t total_ = 0;
+  size_t used_ = 0;
+};
+
+// Adapters that let std::pmr containers use the allocators above, e.g.
+//   thread_cache_resource r;
+//   std::pmr::vector<int> v(&r);
+// Memory from thread_cache_resource can be freed on any thread.
+class thread_cache_resource : public std::pmr::memory_resource {
+  void* do_allocate(size_t n, size_t align) override {
+    if (align > 16) return ::operator new(n, std::align_val_t(align));
+    return thread_cache_allocator::allocate(n);
+  }
+  void do_deallocate(void* p, size_t n, size_t align) override {
+    if (align > 16) return ::operator delete(p, std::align_val_t(align));
+    thread_cache_allocator::deallocate(p, n);
+  }
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+    return dynamic_cast<const thread_cache_resource*>(&other) != nullptr;
+  }
+};
+
+// Deallocation is a no-op, memory is released by arena::reset().
+class arena_resource : public std::pmr::memory_resource {
+  public:
+  explicit arena_resource(arena& a) : arena_(a) {}
+  private:
+  void* do_allocate(size_t n, size_t align) override { return arena_.allocate(n, align); }
+  void do_deallocate(void*, size_t, size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+  arena& arena_;
+};
@@ -0,0 +1,414 @@
+#!/usr/bin/env python3
+"""Run the example benchmarks built by CMake, save the results as JSON, and
+compare them against a baseline.
+
+  tools/run_benchmarks.py --suite Chapter06 --threads 1,4 --out new.json
+  tools/run_benchmarks.py --suite Chapter06 --threads 1,4 --baseline old.json
+
+Suites are chapters (Chapter06), targets (Chapter06_04c_split_shared_ptr_mbm)
+or shell patterns on either (Chapter0[67], *_mbm). Google Benchmark programs
+are run with --benchmark_repetitions and every repetition is kept; other
+programs are run several times and timed as a whole. Size and thread sweeps
+select from the arguments each benchmark registers (the /1024 and threads:4
+parts of the benchmark name), they can't add new ones.
+
+With --perf, each benchmark is run once more with hardware counters (cycles,
+instructions, LLC misses, branch misses) enabled for the child process, and
+instructions per cycle and misses per 1000 instructions are attached to the
+result. The counters cover the whole process, including the setup and the
+runs Google Benchmark makes to choose the iteration count, so only ratios
+are reported, not counts per iteration; they are most meaningful for
+long-running benchmarks. If perf_event_open is not permitted
+(perf_event_paranoid, VMs, containers), the counters are omitted.
+
+With --baseline, every benchmark present in both runs is compared with the
+Mann-Whitney U test on the repetition times. A benchmark is reported as a
+regression (or improvement) if the difference of the medians is larger than
+--threshold and significant at --alpha. The exit status is 1 if there are
+regressions.
+"""
+
+import argparse
+import ctypes
+import datetime
+import fnmatch
+import json
+import math
+import os
+import platform
+import re
+import socket
+import statistics
+import struct
+import subprocess
+import sys
+import time
+
+TIME_UNITS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+# ---------------------------------------------------------------------------
+# Hardware counters for child processes. The counters are opened by the child
+# itself between fork and exec, with enable_on_exec=1 so they count only the
+# benchmark program and inherit=1 so they count all of its threads, and the
+# file descriptors are passed back to the driver over a socket. The events are
+# one group, so they are always on the PMU together; if the group had to share
+# the PMU with other users, the counts are scaled by time enabled / running.
+
+class perf_event_attr(ctypes.Structure):
+    _fields_ = [("type", ctypes.c_uint32), ("size", ctypes.c_uint32),
+                ("config", ctypes.c_uint64), ("sample_period", ctypes.c_uint64),
+                ("sample_type", ctypes.c_uint64), ("read_format", ctypes.c_uint64),
+                ("flags", ctypes.c_uint64), ("wakeup_events", ctypes.c_uint32),
+                ("bp_type", ctypes.c_uint32), ("config1", ctypes.c_uint64),
+                ("config2", ctypes.c_uint64), ("branch_sample_type", ctypes.c_uint64),
+                ("sample_regs_user", ctypes.c_uint64), ("sample_stack_user", ctypes.c_uint32),
+                ("clockid", ctypes.c_int32), ("sample_regs_intr", ctypes.c_uint64),
+                ("aux_watermark", ctypes.c_uint32), ("sample_max_stack", ctypes.c_uint16),
+                ("reserved", ctypes.c_uint16)]
+
+
+class PerfCounters:
+    PERF_TYPE_HARDWARE = 0
+    PERF_TYPE_HW_CACHE = 3
+    # name: (type, config)
+    EVENTS = {
+        "cycles": (PERF_TYPE_HARDWARE, 0),
+        "instructions": (PERF_TYPE_HARDWARE, 1),
+        "branch_misses": (PERF_TYPE_HARDWARE, 5),
+        # LL cache, read access, miss
+        "llc_misses": (PERF_TYPE_HW_CACHE, 2 | (0 << 8) | (1 << 16)),
+    }
+    SYS_perf_event_open = {"x86_64": 298, "aarch64": 241}.get(platform.machine())
+    FLAG_DISABLED, FLAG_INHERIT, FLAG_EXCLUDE_KERNEL, FLAG_EXCLUDE_HV = 1 << 0, 1 << 1, 1 << 5, 1 << 6
+    FLAG_ENABLE_ON_EXEC = 1 << 12
+    PERF_FORMAT_TOTAL_TIME_ENABLED, PERF_FORMAT_TOTAL_TIME_RUNNING = 1 << 0, 1 << 1
+
+    def __init__(self):
+        self.events = []
+        if not sys.platform.startswith("linux") or self.SYS_perf_event_open is None:
+            return
+        self.libc = ctypes.CDLL(None, use_errno=True)
+        # Open the group once here to find out which events are permitted.
+        for name, fd in self.open_group():
+            self.events.append(name)
+            os.close(fd)
+
+    def available(self):
+        return bool(self.events)
+
+    def open_group(self):
+        """Open the events as one group on the calling process, return [(name, fd)]."""
+        fds = []
+        for name, (type_, config) in self.EVENTS.items():
+            attr = perf_event_attr()
+            attr.type = type_
+            attr.size = ctypes.sizeof(attr)
+            attr.config = config
+            attr.read_format = self.PERF_FORMAT_TOTAL_TIME_ENABLED | self.PERF_FORMAT_TOTAL_TIME_RUNNING
+            attr.flags = self.FLAG_INHERIT | self.FLAG_EXCLUDE_KERNEL | self.FLAG_EXCLUDE_HV
+            if not fds:         # The group leader starts the group on exec
+                attr.flags |= self.FLAG_DISABLED | self.FLAG_ENABLE_ON_EXEC
+            fd = self.libc.syscall(self.SYS_perf_event_open, ctypes.byref(attr), 0, -1, fds[0][1] if fds else -1, 0)
+            if fd >= 0:
+                fds.append((name, fd))
+        return fds
+
+    def run(self, cmd, timeout=None, capture_output=False, preexec_fn=None, **kwargs):
+        """Run cmd with the counters enabled, return (CompletedProcess, counts)."""
+        sock, child_sock = socket.socketpair(socket.AF_UNIX, socket.SOCK_DGRAM)
+
+        def open_counters():    # Runs in the child
+            if preexec_fn:
+                preexec_fn()
+            fds = self.open_group()
+            socket.send_fds(child_sock, [json.dumps([name for name, _ in fds]).encode()], [fd for _, fd in fds])
+            for _, fd in fds:
+                os.close(fd)
+
+        if capture_output:
+            kwargs["stdout"] = kwargs["stderr"] = subprocess.PIPE
+        with sock, child_sock:
+            with subprocess.Popen(cmd, preexec_fn=open_counters, **kwargs) as p:
+                try:
+                    out, err = p.communicate(timeout=timeout)
+                except subprocess.TimeoutExpired:
+                    p.kill()
+                    p.communicate()
+                    raise
+            res = subprocess.CompletedProcess(cmd, p.returncode, out, err)
+            sock.setblocking(False)
+            msg, fds, _, _ = socket.recv_fds(sock, 4096, len(self.EVENTS))
+        counts = {}
+        for name, fd in zip(json.loads(msg), fds):
+            value, enabled, running = struct.unpack("=QQQ", os.read(fd, 24))
+            os.close(fd)
+            if running:
+                counts[name] = round(value*enabled/running)
+        return res, counts
+
+
+# ---------------------------------------------------------------------------
+# Statistics
+
+def mann_whitney_p(a, b):
+    """Two-sided p-value of the Mann-Whitney U test (normal approximation with
+    tie correction)."""
+    n1, n2 = len(a), len(b)
+    if n1 == 0 or n2 == 0:
+        return 1.0
+    values = sorted([(x, 0) for x in a] + [(x, 1) for x in b])
+    ranks = [0.0]*len(values)
+    ties = 0.0
+    i = 0
+    while i < len(values):
+        j = i
+        while j + 1 < len(values) and values[j + 1][0] == values[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j)/2 + 1
+        t = j - i + 1
+        ties += t**3 - t
+        i = j + 1
+    r1 = sum(r for r, (_, g) in zip(ranks, values) if g == 0)
+    u = r1 - n1*(n1 + 1)/2
+    n = n1 + n2
+    var = n1*n2/12*((n + 1) - ties/(n*(n - 1)))
+    if var <= 0:
+        return 1.0
+    z = (abs(u - n1*n2/2) - 0.5)/math.sqrt(var)     # With continuity correction
+    return max(0.0, min(1.0, math.erfc(max(z, 0)/math.sqrt(2))))
+
+
+# ---------------------------------------------------------------------------
+# Running
+
+def select(manifest, suites):
+    if not suites:
+        return manifest
+    return [b for b in manifest
+            if any(fnmatch.fnmatchcase(b["suite"], s) or fnmatch.fnmatchcase(b["target"], s) for s in suites)]
+
+
+def parse_cpus(spec):
+    cpus = set()
+    for part in spec.split(","):
+        lo, _, hi = part.partition("-")
+        cpus.update(range(int(lo), int(hi or lo) + 1))
+    return cpus
+
+
+def wanted(name, args):
+    """Does the Google Benchmark name match --filter, --sizes and --threads?"""
+    if args.filter and not re.search(args.filter, name):
+        return False
+    parts = name.split("/")
+    if args.sizes and not set(args.sizes.split(",")) & set(parts[1:]):
+        return False
+    if args.threads:
+        threads = next((p[len("threads:"):] for p in parts if p.startswith("threads:")), "1")
+        if threads not in args.threads.split(","):
+            return False
+    return True
+
+
+def exact_filter(names):
+    """--benchmark_filter that matches exactly these names (POSIX extended regex)."""
+    return "^(%s)$" % "|".join(re.sub(r"([][.*+?^$(){}|\\])", r"\\\1", n) for n in names)
+
+
+def run_gbench(exe, bench, args, run):
+    cmd = [exe, "--benchmark_format=json", "--benchmark_repetitions=%d" % args.repetitions]
+    if args.min_time:
+        cmd.append("--benchmark_min_time=%s" % args.min_time)
+    if args.filter or args.sizes or args.threads:
+        res = run([exe, "--benchmark_list_tests"])
+        names = [n for n in res.stdout.split() if wanted(n, args)]
+        if not names:
+            return []
+        cmd.append("--benchmark_filter=%s" % exact_filter(names))
+    res = run(cmd)
+    if res.returncode != 0:
+        raise RuntimeError("exit status %d: %s" % (res.returncode, res.stderr.strip()[-500:]))
+    out = json.loads(res.stdout) if res.stdout.strip() else {"benchmarks": []}
+    results = {}
+    for b in out["benchmarks"]:
+        if b.get("run_type", "iteration") != "iteration":
+            continue
+        if b.get("error_occurred"):
+            print("  %s: %s" % (b["name"], b.get("error_message")), file=sys.stderr)
+            continue
+        name = b.get("run_name", b["name"])
+        scale = TIME_UNITS[b.get("time_unit", "ns")]
+        r = results.setdefault(name, {
+            "suite": bench["suite"], "target": bench["target"], "name": name,
+            "real_time_ns": [], "cpu_time_ns": [], "iterations": [], "counters": {}})
+        r["real_time_ns"].append(b["real_time"]*scale)
+        r["cpu_time_ns"].append(b["cpu_time"]*scale)
+        r["iterations"].append(b["iterations"])
+        skip = {"name", "run_name", "run_type", "family_index", "per_family_instance_index", "repetitions",
+                "repetition_index", "threads", "iterations", "real_time", "cpu_time", "time_unit"}
+        for k, v in b.items():
+            if k not in skip and isinstance(v, (int, float)):
+                r["counters"].setdefault(k, []).append(v)
+    return list(results.values())
+
+
+def run_main(exe, bench, args, run):
+    times = []
+    for _ in range(args.repetitions):
+        t0 = time.perf_counter()
+        res = run([exe])
+        t1 = time.perf_counter()
+        if res.returncode != 0:
+            raise RuntimeError("exit status %d: %s" % (res.returncode, res.stderr.strip()[-500:]))
+        times.append((t1 - t0)*1e9)
+    return [{"suite": bench["suite"], "target": bench["target"], "name": bench["target"],
+             "real_time_ns": times, "cpu_time_ns": [], "iterations": [1]*len(times), "counters": {},
+             "output": res.stdout[-2000:]}]
+
+
+def attach_perf(exe, result, counters, run_kwargs):
+    """Run one benchmark once more with hardware counters, store the ratios."""
+    cmd = [exe]
+    if result["target"] != result["name"]:        # Google Benchmark program
+        cmd.append("--benchmark_filter=%s" % exact_filter([result["name"]]))
+    res, counts = counters.run(cmd, **run_kwargs)
+    if res.returncode != 0:
+        return
+    perf = {}
+    if counts.get("cycles"):
+        perf["ipc"] = counts.get("instructions", 0)/counts["cycles"]
+    if counts.get("instructions"):
+        for name in ("llc_misses", "branch_misses"):
+            if name in counts:
+                perf[name + "_pki"] = 1000*counts[name]/counts["instructions"]
+    if perf:
+        result["perf"] = perf
+
+
+def run(args):
+    with open(os.path.join(args.build_dir, "benchmarks.json")) as f:
+        manifest = json.load(f)
+    benches = select(manifest, args.suite)
+    if not benches:
+        sys.exit("No benchmarks match %s" % args.suite)
+
+    cpus = parse_cpus(args.cpus) if args.cpus else None
+    run_kwargs = {"capture_output": True, "text": True, "timeout": args.timeout,
+                  "preexec_fn": (lambda: os.sched_setaffinity(0, cpus)) if cpus else None}
+    counters = PerfCounters() if args.perf else None
+    if counters and not counters.available():
+        print("Hardware counters are not available, --perf ignored", file=sys.stderr)
+        counters = None
+
+    results = []
+    for bench in benches:
+        exe = os.path.join(args.build_dir, bench["path"])
+        if not os.path.exists(exe):
+            print("%s: not built" % bench["target"], file=sys.stderr)
+            continue
+        print(bench["target"], file=sys.stderr)
+        try:
+            runner = run_gbench if bench["kind"] == "gbench" else run_main
+            rs = runner(exe, bench, args, lambda cmd: subprocess.run(cmd, **run_kwargs))
+        except (RuntimeError, subprocess.TimeoutExpired, ValueError) as e:
+            print("  failed: %s" % e, file=sys.stderr)
+            continue
+        for r in rs:
+            r["median_ns"] = statistics.median(r["real_time_ns"])
+            if counters:
+                attach_perf(exe, r, counters, run_kwargs)
+            print("  %-60s %12.1f ns" % (r["name"], r["median_ns"]), file=sys.stderr)
+        results.extend(rs)
+
+    return {
+        "context": {
+            "date": datetime.datetime.now().isoformat(timespec="seconds"),
+            "host": platform.node(),
+            "machine": platform.machine(),
+            "num_cpus": os.cpu_count(),
+            "cpus": sorted(cpus) if cpus else None,
+            "git": git_revision(),
+            "repetitions": args.repetitions,
+        },
+        "results": results,
+    }
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], capture_output=True, text=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__))).stdout.strip() or None
+    except OSError:
+        return None
+
+
+# ---------------------------------------------------------------------------
+# Comparing
+
+def compare(new, baseline, alpha, threshold):
+    base = {(r["target"], r["name"]): r for r in baseline["results"]}
+    regressions = 0
+    rows = []
+    for r in new["results"]:
+        b = base.get((r["target"], r["name"]))
+        if not b:
+            continue
+        old_t, new_t = statistics.median(b["real_time_ns"]), statistics.median(r["real_time_ns"])
+        change = (new_t - old_t)/old_t if old_t else 0.0
+        p = mann_whitney_p(b["real_time_ns"], r["real_time_ns"])
+        verdict = ""
+        if p < alpha and abs(change) > threshold:
+            verdict = "REGRESSION" if change > 0 else "improvement"
+            regressions += change > 0
+        r["baseline"] = {"median_ns": old_t, "change": change, "p_value": p, "verdict": verdict or None}
+        rows.append((r["name"], old_t, new_t, change, p, verdict))
+
+    if rows:
+        width = max(len(row[0]) for row in rows)
+        print("%-*s %12s %12s %8s %7s" % (width, "Benchmark", "Baseline ns", "New ns", "Change", "p"))
+        for name, old_t, new_t, change, p, verdict in rows:
+            print("%-*s %12.1f %12.1f %+7.1f%% %7.3f %s" % (width, name, old_t, new_t, 100*change, p, verdict))
+    print("%d benchmarks compared, %d regressions" % (len(rows), regressions))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--build-dir", default="build", help="CMake build directory (default: build)")
+    parser.add_argument("--suite", action="append", help="chapter, target or pattern, may be repeated (default: all)")
+    parser.add_argument("--filter", help="regex on Google Benchmark names")
+    parser.add_argument("--sizes", help="comma-separated benchmark arguments to run, e.g. 1024,65536")
+    parser.add_argument("--threads", help="comma-separated thread counts to run, e.g. 1,2,4")
+    parser.add_argument("--repetitions", type=int, default=5, help="runs of each benchmark (default: 5)")
+    parser.add_argument("--min-time", help="Google Benchmark --benchmark_min_time")
+    parser.add_argument("--cpus", help="pin benchmarks to these CPUs, e.g. 0-3,8")
+    parser.add_argument("--timeout", type=float, default=600, help="seconds per program run (default: 600)")
+    parser.add_argument("--perf", action="store_true", help="attach hardware counters to each result")
+    parser.add_argument("--out", help="write results to this JSON file")
+    parser.add_argument("--baseline", help="compare against results from this JSON file")
+    parser.add_argument("--compare-only", metavar="NEW", help="compare NEW results file against --baseline, don't run")
+    parser.add_argument("--alpha", type=float, default=0.05, help="significance level (default: 0.05)")
+    parser.add_argument("--threshold", type=float, default=0.05, help="minimum relative change to report (default: 0.05)")
+    args = parser.parse_args()
+
+    if args.compare_only:
+        if not args.baseline:
+            parser.error("--compare-only needs --baseline")
+        with open(args.compare_only) as f:
+            new = json.load(f)
+    else:
+        new = run(args)
+    regressions = 0
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(new, json.load(f), args.alpha, args.threshold)
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(new, f, indent=1)
+    sys.exit(1 if regressions else 0)
+
+
+if __name__ == "__main__":
+    main()